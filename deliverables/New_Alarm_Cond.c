@@ -7,9 +7,15 @@
  * the alarm wait time.
  * Alarms can be canceled, after which they will never display again.
  */
+#define _GNU_SOURCE		 /* CPU sets and thread affinity */
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "errors.h"
+#include "alarm_ring.h"
 
 /*
  * The "alarm" structure contains different variables that help the
@@ -30,6 +36,25 @@ typedef struct alarm_tag {
     int	      	     new;        /* alarm is new = 1, 0 otherwise */
     int	      	     modified;   /* alarm modfied = 1, 0 otherwise */
     int	      	     linked;     /* alarm is in list = 1, 0 otherwise */
+    int	      	     version;    /* message version, incremented by every
+				  * replacement
+				  */
+    int	      	     priority;   /* priority class, 0 = most urgent */
+    int	      	     maxDisplays;/* alarm expires after this number of
+				  * displays, 0 = never
+				  */
+    int	      	     ttl;        /* alarm expires this number of seconds
+				  * after its request, 0 = never
+				  */
+    time_t           expires;    /* seconds from EPOCH, 0 = never */
+    int	      	     retired;    /* alarm expired and waits in the list to
+				  * be reclaimed = 1, 0 otherwise
+				  */
+    int	      	     wakeup;     /* display thread must re-read the alarm
+				  * before its deadline = 1, 0 otherwise
+				  */
+    pthread_mutex_t  lock;       /* protects wakeup */
+    pthread_cond_t   cond;       /* interrupts the display thread's wait */
 } alarm_t;
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;   /* semaphore for safe
@@ -44,10 +69,734 @@ alarm_t *head, *tail;		 /* dummy variables used to point to the head
 int read_count;			 /* stores the number of threads that are
 				  * currently reading the alarm list
 				  */
+pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER; /* semaphore for
+						      * safe access of
+						      * new_count
+						      */
+pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER; /* signaled when
+						      * new_count increases,
+						      * and when the first
+						      * or a full batch of
+						      * expired alarms waits
+						      */
+int new_count;			 /* stores the number of requests added to the
+				  * alarm list since the alarm thread last
+				  * found it without new requests
+				  */
+int retired_count;		 /* stores the number of expired alarms
+				  * waiting in the alarm list to be reclaimed
+				  */
+
+/*
+ * Expired alarms are unlinked and freed by the alarm thread in batches:
+ * as soon as RECLAIM_BATCH of them are waiting, or when the alarm thread
+ * has been idle for RECLAIM_DELAY seconds with some of them waiting.
+ */
+#define RECLAIM_BATCH		64
+#define RECLAIM_DELAY		1
+
+/*
+ * Output events.
+ * Every line the program used to print is an event. In the default text
+ * mode events are printed as before. In binary and JSON Lines mode they
+ * are encoded straight into a shared output buffer, which is written out
+ * when it is full or when an emitting thread is about to block.
+ */
+#define EV_FIRST_REQUEST	1  /* First Alarm Request ... Received */
+#define EV_REPLACEMENT_REQUEST	2  /* Replacement Alarm Request ... Received */
+#define EV_CANCEL_REQUEST	3  /* Cancel Alarm Request ... Received */
+#define EV_NO_ALARM_ERROR	4  /* Error: No Alarm Request ... to Cancel! */
+#define EV_DUP_CANCEL_ERROR	5  /* Error: More Than One Request to Cancel */
+#define EV_PROCESSED		6  /* Alarm Request ... Proccessed */
+#define EV_CANCEL_PROCESSED	7  /* Alarm Request ... Proccessed: Cancel */
+#define EV_DISPLAYED		8  /* Alarm ... Displayed */
+#define EV_REPLACED		9  /* Alarm ... Replaced */
+#define EV_REPLACEMENT_DISPLAYED 10 /* Replacement Alarm ... Displayed */
+#define EV_THREAD_EXITING	11 /* Display thread exiting */
+#define EV_EXPIRED		12 /* Alarm ... Expired */
+
+#define OUTPUT_TEXT		0
+#define OUTPUT_BINARY		1
+#define OUTPUT_JSON		2
+
+/*
+ * Binary event record, written in host byte order. Timestamps are
+ * nanoseconds from EPOCH, "scheduled" is 0 for events that are not due
+ * at a given time. The message handle is the version of the alarm's
+ * message: 1 for the first request, incremented by every replacement.
+ * EV_FIRST_REQUEST and EV_REPLACEMENT_REQUEST records are followed by
+ * the 64 byte, NUL padded message that the handle refers to.
+ */
+typedef struct event_tag {
+    int32_t          type;       /* one of the EV_ values */
+    int32_t          alarmNum;   /* the alarm message number */
+    int64_t          scheduled;  /* when the event was due */
+    int64_t          actual;     /* when the event happened */
+    int32_t          seconds;    /* the alarm period */
+    uint32_t         handle;     /* the alarm message version */
+} event_t;
+
+#define OUTPUT_BUFFER_SIZE 65536
+
+int output_mode = OUTPUT_TEXT;	 /* selected with -f at startup */
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER; /* semaphore for
+						      * safe access of the
+						      * output buffer
+						      */
+union {
+    event_t          records[OUTPUT_BUFFER_SIZE / sizeof (event_t)];
+    char             bytes[OUTPUT_BUFFER_SIZE];
+} output_buffer;		 /* events waiting to be written, aligned
+				  * for in place binary records
+				  */
+size_t output_length;		 /* bytes used in output_buffer */
+
+/* HELPER METHOD
+ *
+ * Writes the output buffer to stdout and empties it.
+ * Requires that the caller have locked the output_mutex.
+ */
+void flushOutputLocked()
+{
+    size_t done;
+    ssize_t count;
+
+    done = 0;
+    while (done < output_length)
+    {
+		count = write (STDOUT_FILENO, output_buffer.bytes + done,
+		    output_length - done);
+		if (count < 0 && errno == EINTR)
+		    continue;
+		if (count < 0)
+		    errno_abort ("Write output");
+		done += count;
+    }
+    output_length = 0;
+}
+
+/* HELPER METHOD
+ *
+ * Writes out pending events. Called by a thread before it blocks, so
+ * that events never sit in the buffer while the program is idle.
+ */
+void flushOutput()
+{
+    int status;
+
+    if (output_mode == OUTPUT_TEXT)
+    {
+		fflush (stdout);
+		return;
+    }
+    status = pthread_mutex_lock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (output_length > 0)
+		flushOutputLocked();
+    status = pthread_mutex_unlock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/* HELPER METHOD
+ *
+ * Appends an event as a JSON line to the output buffer, escaping the
+ * message. Returns 0 if the buffer was too small to hold it.
+ * Requires that the caller have locked the output_mutex.
+ */
+int appendJsonLocked(int type, alarm_t *alarm, int64_t scheduled,
+    int64_t actual)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *out, *end;
+    const char *c;
+    int count;
+
+    out = output_buffer.bytes + output_length;
+    end = output_buffer.bytes + OUTPUT_BUFFER_SIZE;
+    count = snprintf (out, end - out,
+	"{\"type\":%d,\"alarm\":%d,\"scheduled\":%lld,\"actual\":%lld,"
+	"\"seconds\":%d,\"handle\":%u",
+	type, alarm->alarmNum, (long long)scheduled, (long long)actual,
+	alarm->seconds, (unsigned)alarm->version);
+    if (count < 0 || count >= end - out)
+		return 0;
+    out += count;
+    if (type == EV_FIRST_REQUEST || type == EV_REPLACEMENT_REQUEST)
+    {
+		/* Worst case every character needs a \u00XX escape */
+		if (end - out < 12 + 6 * (int)sizeof (alarm->message))
+		    return 0;
+		memcpy (out, ",\"message\":\"", 12);
+		out += 12;
+		for (c = alarm->message; *c != '\0'; c++)
+		{
+		    if (*c == '"' || *c == '\\')
+		    {
+			*out++ = '\\';
+			*out++ = *c;
+		    }
+		    else if ((unsigned char)*c < 0x20)
+		    {
+			memcpy (out, "\\u00", 4);
+			out[4] = hex[(*c >> 4) & 0xf];
+			out[5] = hex[*c & 0xf];
+			out += 6;
+		    }
+		    else
+			*out++ = *c;
+		}
+		*out++ = '"';
+    }
+    if (end - out < 2)
+		return 0;
+    *out++ = '}';
+    *out++ = '\n';
+    output_length = out - output_buffer.bytes;
+    return 1;
+}
+
+/* HELPER METHOD
+ *
+ * Appends an event as a binary record to the output buffer. Returns 0
+ * if the buffer was too small to hold it.
+ * Requires that the caller have locked the output_mutex.
+ */
+int appendRecordLocked(int type, alarm_t *alarm, int64_t scheduled,
+    int64_t actual)
+{
+    event_t *record;
+    size_t size;
+
+    size = sizeof (event_t);
+    if (type == EV_FIRST_REQUEST || type == EV_REPLACEMENT_REQUEST)
+		size += sizeof (alarm->message);
+    if (OUTPUT_BUFFER_SIZE - output_length < size)
+		return 0;
+    /* Records are multiples of 8 bytes, so this one is aligned */
+    record = (event_t *)(output_buffer.bytes + output_length);
+    record->type = type;
+    record->alarmNum = alarm->alarmNum;
+    record->scheduled = scheduled;
+    record->actual = actual;
+    record->seconds = alarm->seconds;
+    record->handle = alarm->version;
+    if (size > sizeof (event_t))
+		strncpy ((char *)(record + 1), alarm->message,
+		    size - sizeof (event_t));
+    output_length += size;
+    return 1;
+}
+
+/*
+ * Reports an event about an alarm in the output mode selected at
+ * startup. "scheduled" is the second the event was due, 0 if none.
+ * Returns the time the event was reported, in nanoseconds from EPOCH.
+ */
+int64_t emitEvent(int type, alarm_t *alarm, time_t scheduled)
+{
+    struct timespec now;
+    int64_t actual;
+    int status, done;
+
+    clock_gettime (CLOCK_REALTIME, &now);
+    actual = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    if (output_mode == OUTPUT_TEXT)
+    {
+		switch (type)
+		{
+		case EV_FIRST_REQUEST:
+		    printf("First Alarm Request With Message Number (%d) " 	
+		           "Received at %d: %d Message(%d) %s\n",
+			   alarm->alarmNum, now.tv_sec, alarm->seconds,
+		           alarm->alarmNum, alarm->message);
+		    break;
+		case EV_REPLACEMENT_REQUEST:
+		    printf("Replacement Alarm Request With Message Number (%d) " 	
+		           "Received at %d: %d Message(%d) %s\n",
+			   alarm->alarmNum, now.tv_sec, alarm->seconds, 
+			   alarm->alarmNum, alarm->message);
+		    break;
+		case EV_CANCEL_REQUEST:
+		    printf("Cancel Alarm Request With Message Number (%d) " 	
+			   "Received at %d: Cancel: Message(%d)\n",
+			   alarm->alarmNum, now.tv_sec, alarm->alarmNum);
+		    break;
+		case EV_NO_ALARM_ERROR:
+		    printf("Error: No Alarm Request With Message Number (%d) " 	
+			   "to Cancel!\n", alarm->alarmNum);
+		    break;
+		case EV_DUP_CANCEL_ERROR:
+		    printf("Error: More Than One Request to Cancel "
+			   "Alarm Request With Message Number (%d)!\n",
+			   alarm->alarmNum);
+		    break;
+		case EV_PROCESSED:
+		    printf("Alarm Request With Message Number (%d) Proccessed at %d: "
+			"%d Message(%d) %s\n",
+			alarm->alarmNum, now.tv_sec, alarm->seconds, alarm->alarmNum,
+			alarm->message);
+		    break;
+		case EV_CANCEL_PROCESSED:
+		    printf("Alarm Request With Message Number(%d) Proccessed at %d: "
+			"Cancel: Message(%d)\n",
+			alarm->alarmNum, now.tv_sec, alarm->alarmNum);
+		    break;
+		case EV_DISPLAYED:
+		    printf("Alarm With Message Number (%d) Displayed at %d: "
+			"%d Message(%d) %s\n",
+			alarm->alarmNum, now.tv_sec, alarm->seconds, alarm->alarmNum,
+			alarm->message);
+		    break;
+		case EV_REPLACED:
+		    printf("Alarm With Message Number (%d) Replaced at %d: "
+			"%d Message(%d) %s\n",
+			alarm->alarmNum, now.tv_sec, alarm->seconds, alarm->alarmNum,
+			alarm->message);
+		    break;
+		case EV_REPLACEMENT_DISPLAYED:
+		    printf("Replacement Alarm With Message Number (%d) Displayed "
+			   "at %d: %d Message(%d) %s\n",
+			alarm->alarmNum, now.tv_sec, alarm->seconds, alarm->alarmNum,
+			alarm->message);
+		    break;
+		case EV_EXPIRED:
+		    printf("Alarm With Message Number (%d) Expired at %ld: "
+			"%d Message(%d) %s\n",
+			alarm->alarmNum, (long)now.tv_sec, alarm->seconds,
+			alarm->alarmNum, alarm->message);
+		    break;
+		case EV_THREAD_EXITING:
+		    printf("Display thread exiting at %d: %d Message(%d) %s\n",
+			now.tv_sec, alarm->seconds, alarm->alarmNum,
+			alarm->message);
+		    break;
+		}
+		return actual;
+    }
+
+    status = pthread_mutex_lock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    /* If the event does not fit, make room and encode it again */
+    do {
+		if (output_mode == OUTPUT_BINARY)
+		    done = appendRecordLocked(type, alarm,
+			(int64_t)scheduled * 1000000000, actual);
+		else
+		    done = appendJsonLocked(type, alarm,
+			(int64_t)scheduled * 1000000000, actual);
+		if (!done)
+		    flushOutputLocked();
+    } while (!done);
+    status = pthread_mutex_unlock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    return actual;
+}
+
+/*
+ * Priority classes.
+ * Alarms belong to class P0 (most urgent) to P3 (bulk, the default), as
+ * defined in alarm_ring.h.
+ * Display threads do not report their events themselves: they queue
+ * them by class, and the queues are drained by output workers. A
+ * dedicated worker, given real time scheduling with -r when the process
+ * is allowed to use it, serves the P0 queue. The bulk worker serves the
+ * other queues, always taking from the most urgent non empty one.
+ */
+#define CRITICAL_PRIORITY	0	/* served by the critical worker */
+
+/*
+ * The events of one display thread. A replacement may move the alarm to
+ * another class; its events keep going to the class they were queued in
+ * until all of them have been reported, so that they stay in order.
+ * A display thread with STREAM_PENDING events pending waits for the
+ * output workers, as it did for stdout when it printed its own lines.
+ */
+#define STREAM_PENDING		16
+
+typedef struct stream_tag {
+    int              pending;    /* events queued or being reported */
+    int              priority;   /* class the pending events are in */
+    int              closed;     /* the display thread has terminated */
+    pthread_cond_t   room;       /* signaled when pending drops below
+				  * STREAM_PENDING
+				  */
+} stream_t;
+
+/*
+ * An event queued by a display thread. The alarm is copied, as it may
+ * be freed before the event is reported; the copy's lock and cond are
+ * never used.
+ */
+typedef struct fire_tag {
+    struct fire_tag  *link;      /* next event in the same class */
+    stream_t         *stream;    /* events of the same display thread */
+    int              priority;   /* class the event was queued in */
+    int              type;       /* one of the EV_ values */
+    time_t           scheduled;  /* when the event was due, 0 if none */
+    alarm_t          alarm;      /* the alarm as it was when queued */
+} fire_t;
+
+/*
+ * Display latency (actual minus scheduled time) of one priority class.
+ */
+typedef struct latency_tag {
+    long             count;      /* number of timed events reported */
+    int64_t          total;      /* sum of their latencies, in ns */
+    int64_t          max;        /* largest latency, in ns */
+} latency_t;
+
+pthread_mutex_t fire_mutex = PTHREAD_MUTEX_INITIALIZER; /* semaphore for
+						      * safe access of the
+						      * fire queues and the
+						      * latency statistics
+						      */
+pthread_cond_t critical_cond = PTHREAD_COND_INITIALIZER; /* P0 queued */
+pthread_cond_t bulk_cond = PTHREAD_COND_INITIALIZER;   /* P1 to P3 queued */
+pthread_cond_t drained_cond = PTHREAD_COND_INITIALIZER; /* all reported */
+int fire_active = 0;			 /* events being reported */
+fire_t *fire_first[NUM_PRIORITIES];	 /* oldest queued event per class */
+fire_t *fire_last[NUM_PRIORITIES];	 /* newest queued event per class */
+latency_t latency[NUM_PRIORITIES];	 /* display latency per class */
+
+/*
+ * Thread placement.
+ * Each kind of thread runs on its own set of CPUs, chosen on the command
+ * line and by default the CPUs the program was started on, and with its
+ * own scheduling policy, so that no thread inherits the placement or the
+ * policy of the thread that created it.
+ */
+cpu_set_t input_cpus;		 /* the main thread, -i */
+cpu_set_t dispatcher_cpus;	 /* the alarm thread, -d */
+cpu_set_t output_cpus;		 /* the output workers, -o */
+cpu_set_t display_cpus;		 /* the display threads, -w */
+int use_realtime;		 /* the alarm thread and the P0 threads use
+				  * SCHED_FIFO = 1, -r
+				  */
+
+/* HELPER METHOD
+ *
+ * Parses a list of CPUs such as "0,2-3" into a CPU set.
+ * Returns 1 if the list is valid, 0 otherwise.
+ */
+int parseCpuList(const char *list, cpu_set_t *cpus)
+{
+    long first, last;
+    char *end;
+
+    CPU_ZERO (cpus);
+    do {
+		first = strtol (list, &end, 10);
+		if (end == list || first < 0 || first >= CPU_SETSIZE)
+		    return 0;
+		last = first;
+		if (*end == '-')
+		{
+		    list = end + 1;
+		    last = strtol (list, &end, 10);
+		    if (end == list || last < first || last >= CPU_SETSIZE)
+			return 0;
+		}
+		for (; first <= last; first++)
+		    CPU_SET (first, cpus);
+		list = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
+
+/* HELPER METHOD
+ *
+ * Creates a thread on the given CPUs. With realtime = 1 the thread
+ * gets the SCHED_FIFO policy, unless the process is not allowed to use
+ * it, in which case it silently gets the default policy. Other threads
+ * always get the default policy, even when created by a real time one.
+ */
+void createThread(pthread_t *thread, void *(*start)(void *), void *arg,
+    int realtime, cpu_set_t *cpus)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    int status;
+
+    pthread_attr_init (&attr);
+    status = pthread_attr_setaffinity_np (&attr, sizeof (cpu_set_t), cpus);
+    if (status != 0)
+        err_abort (status, "Set affinity");
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    status = EPERM;
+    if (realtime)
+    {
+		pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+		param.sched_priority = sched_get_priority_min (SCHED_FIFO) + 1;
+		pthread_attr_setschedparam (&attr, &param);
+		status = pthread_create (thread, &attr, start, arg);
+    }
+    if (status == EPERM)
+    {
+		pthread_attr_setschedpolicy (&attr, SCHED_OTHER);
+		param.sched_priority = 0;
+		pthread_attr_setschedparam (&attr, &param);
+		status = pthread_create (thread, &attr, start, arg);
+    }
+    pthread_attr_destroy (&attr);
+    if (status != 0)
+        err_abort (status, "Create thread");
+}
+
+/* HELPER METHOD
+ *
+ * Queues an event of a display thread for the output worker of the
+ * alarm's priority class, or of the class of the thread's events that
+ * are still pending. Waits while STREAM_PENDING events of the thread
+ * are pending. EV_THREAD_EXITING closes the stream; it is freed once its
+ * last event has been reported.
+ */
+void queueFire(stream_t *stream, int type, alarm_t *alarm, time_t scheduled)
+{
+    fire_t *fire;
+    int status, priority;
+
+    fire = (fire_t*)malloc (sizeof (fire_t));
+    if (fire == NULL)
+        errno_abort ("Allocate fire");
+    fire->link = NULL;
+    fire->stream = stream;
+    fire->type = type;
+    fire->scheduled = scheduled;
+    fire->alarm = *alarm;
+    status = pthread_mutex_lock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (stream->pending >= STREAM_PENDING)
+    {
+		status = pthread_cond_wait (&stream->room, &fire_mutex);
+		if (status != 0)
+		    err_abort (status, "Wait on cond");
+    }
+    if (stream->pending == 0)
+		stream->priority = alarm->priority;
+    stream->pending++;
+    if (type == EV_THREAD_EXITING)
+		stream->closed = 1;
+    priority = stream->priority;
+    fire->priority = priority;
+    if (fire_last[priority] == NULL)
+		fire_first[priority] = fire;
+    else
+		fire_last[priority]->link = fire;
+    fire_last[priority] = fire;
+    if (priority == CRITICAL_PRIORITY)
+		status = pthread_cond_signal (&critical_cond);
+    else
+		status = pthread_cond_signal (&bulk_cond);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+    status = pthread_mutex_unlock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/* HELPER METHOD
+ *
+ * Returns 1 if any class has queued events, 0 otherwise. The caller
+ * holds fire_mutex.
+ */
+int firesQueued()
+{
+    int priority;
+
+    for (priority = 0; priority < NUM_PRIORITIES; priority++)
+		if (fire_first[priority] != NULL)
+		    return 1;
+    return 0;
+}
+
+/* HELPER METHOD
+ *
+ * Waits until every queued event has been reported, then flushes the
+ * output. Used before exiting.
+ */
+void drainFires()
+{
+    int status;
+
+    status = pthread_mutex_lock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (firesQueued() || fire_active > 0)
+    {
+		status = pthread_cond_wait (&drained_cond, &fire_mutex);
+		if (status != 0)
+		    err_abort (status, "Wait on cond");
+    }
+    status = pthread_mutex_unlock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    flushOutput();
+}
+
+/*
+ * Output worker thread.
+ * Reports the queued events of the priority classes from P(first) to
+ * P(last), most urgent class first, and records their latency.
+ * Output is flushed whenever the worker runs out of events.
+ */
+void *output_worker_thread (void *arg)
+{
+    int first, last, priority, status;
+    pthread_cond_t *cond;
+    fire_t *fire;
+    int64_t actual, delay;
+
+    first = (int)(intptr_t)arg;
+    last = first == CRITICAL_PRIORITY ? CRITICAL_PRIORITY : NUM_PRIORITIES - 1;
+    cond = first == CRITICAL_PRIORITY ? &critical_cond : &bulk_cond;
+    status = pthread_mutex_lock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (1)
+    {
+		fire = NULL;
+		for (priority = first; priority <= last && fire == NULL; priority++)
+		{
+		    fire = fire_first[priority];
+		    if (fire != NULL)
+		    {
+			fire_first[priority] = fire->link;
+			if (fire_first[priority] == NULL)
+			    fire_last[priority] = NULL;
+		    }
+		}
+		if (fire == NULL)
+		{
+		    status = pthread_mutex_unlock (&fire_mutex);
+		    if (status != 0)
+			err_abort (status, "Unlock mutex");
+		    flushOutput();
+		    status = pthread_mutex_lock (&fire_mutex);
+		    if (status != 0)
+			err_abort (status, "Lock mutex");
+		    /* Events may have been queued while flushing */
+		    for (priority = first; priority <= last; priority++)
+			if (fire_first[priority] != NULL)
+			    break;
+		    if (priority > last)
+		    {
+			status = pthread_cond_wait (cond, &fire_mutex);
+			if (status != 0)
+			    err_abort (status, "Wait on cond");
+		    }
+		    continue;
+		}
+		fire_active++;
+		status = pthread_mutex_unlock (&fire_mutex);
+		if (status != 0)
+		    err_abort (status, "Unlock mutex");
+
+		actual = emitEvent(fire->type, &fire->alarm, fire->scheduled);
+
+		status = pthread_mutex_lock (&fire_mutex);
+		if (status != 0)
+		    err_abort (status, "Lock mutex");
+		if (fire->scheduled != 0)
+		{
+		    priority = fire->priority;
+		    delay = actual - (int64_t)fire->scheduled * 1000000000;
+		    latency[priority].count++;
+		    latency[priority].total += delay;
+		    if (delay > latency[priority].max)
+			latency[priority].max = delay;
+		}
+		fire->stream->pending--;
+		if (fire->stream->closed && fire->stream->pending == 0)
+		{
+		    pthread_cond_destroy (&fire->stream->room);
+		    free (fire->stream);
+		}
+		else if (fire->stream->pending == STREAM_PENDING - 1)
+		{
+		    status = pthread_cond_signal (&fire->stream->room);
+		    if (status != 0)
+			err_abort (status, "Signal cond");
+		}
+		free (fire);
+		fire_active--;
+		if (fire_active == 0 && !firesQueued())
+		{
+		    status = pthread_cond_broadcast (&drained_cond);
+		    if (status != 0)
+			err_abort (status, "Broadcast cond");
+		}
+    }
+}
+
+/* HELPER METHOD
+ *
+ * Prints the display latency of every priority class that had timed
+ * events to stderr.
+ */
+void printLatency()
+{
+    int priority, status;
+
+    status = pthread_mutex_lock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (priority = 0; priority < NUM_PRIORITIES; priority++)
+    {
+		if (latency[priority].count == 0)
+		    continue;
+		fprintf (stderr, "P%d: %ld displays, latency average %.3f ms, "
+		    "maximum %.3f ms\n", priority, latency[priority].count,
+		    latency[priority].total / 1e6 / latency[priority].count,
+		    latency[priority].max / 1e6);
+    }
+    status = pthread_mutex_unlock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/* HELPER METHOD
+ *
+ * Wakes the display thread of an alarm so that it re-reads the alarm
+ * (new period, new message or cancellation) without waiting for its
+ * current deadline.
+ * May be called with the rw_mutex locked, never the other way round.
+ */
+void wakeAlarm(alarm_t *alarm)
+{
+    int status;
+
+    status = pthread_mutex_lock (&alarm->lock);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    alarm->wakeup = 1;
+    status = pthread_cond_signal (&alarm->cond);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+    status = pthread_mutex_unlock (&alarm->lock);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/* HELPER METHOD
+ *
+ * Releases an alarm that is no longer in the alarm list and no longer
+ * referenced by any thread.
+ */
+void freeAlarm(alarm_t *alarm)
+{
+    pthread_mutex_destroy (&alarm->lock);
+    pthread_cond_destroy (&alarm->cond);
+    free (alarm);
+}
 
 /* HELPER METHOD
  * 
- * Searches for a type A alarm in the alarm list
+ * Searches for a type A alarm in the alarm list, expired alarms excluded
  * If alarm is found, returns 1
  * Returns 0 otherwise
  */
@@ -61,7 +810,7 @@ int searchAlarmA(alarm_t *alarm)
     while (next != tail)
     {
 	 	if (next->alarmNum == alarm->alarmNum
-			&& next->type == 1)
+			&& next->type == 1 && next->retired == 0)
 		{
 		    flag = 1;
 		    break;
@@ -99,7 +848,7 @@ int searchAlarmB(alarm_t *alarm)
 
 /* HELPER METHOD
  *
- * Searches for a type A alarm in the alarm list
+ * Searches for a type A alarm in the alarm list, expired alarms excluded
  * Replaces the alarm in the list with this alarm
  */
 void replaceAlarmA(alarm_t *alarm)
@@ -110,12 +859,18 @@ void replaceAlarmA(alarm_t *alarm)
     while (next != tail)
     {
         if (next->alarmNum == alarm->alarmNum
-		&& next->type == 1)
+		&& next->type == 1 && next->retired == 0)
 		{
 		    strcpy(next->message, alarm->message);
     	    next->time = alarm->time;
     	    next->seconds = alarm->seconds;
+		    next->priority = alarm->priority;
+		    next->maxDisplays = alarm->maxDisplays;
+		    next->expires = alarm->expires;
 		    next->modified = 1;
+		    next->version++;
+		    alarm->version = next->version;
+		    wakeAlarm(next);
 		    break;
 		}
         next = next->link;
@@ -164,18 +919,12 @@ void alarm_insert (alarm_t *alarm)
 		flagA = searchAlarmA(alarm);
 		if(flagA) 
 		{
-		    printf("Replacement Alarm Request With Message Number (%d) " 	
-		           "Received at %d: %d Message(%d) %s\n",
-			   alarm->alarmNum, time(NULL), alarm->seconds, 
-			   alarm->alarmNum, alarm->message);
             	    replaceAlarmA(alarm);
+		    emitEvent(EV_REPLACEMENT_REQUEST, alarm, 0);
 		}
 		if (!flagA)
 		{
-		    printf("First Alarm Request With Message Number (%d) " 	
-		           "Received at %d: %d Message(%d) %s\n",
-			   alarm->alarmNum, time(NULL), alarm->seconds,
-		           alarm->alarmNum, alarm->message);
+		    emitEvent(EV_FIRST_REQUEST, alarm, 0);
 		    previous = head;
 		    next = head->link;
 		    while (next != tail) 
@@ -202,20 +951,15 @@ void alarm_insert (alarm_t *alarm)
     else
     {
 		flagA = searchAlarmA(alarm);
-		if(!flagA) printf("Error: No Alarm Request With Message Number (%d) " 	
-		          "to Cancel!\n",alarm->alarmNum);
+		if(!flagA) emitEvent(EV_NO_ALARM_ERROR, alarm, 0);
 		if(flagA)
 		{
 		    flagB=searchAlarmB(alarm);
 		    if(flagB) 
-				printf("Error: More Than One Request to Cancel "
-			       "Alarm Request With Message Number (%d)!\n"
-			       ,alarm->alarmNum);
+				emitEvent(EV_DUP_CANCEL_ERROR, alarm, 0);
 		    else
 		    {
-				printf("Cancel Alarm Request With Message Number (%d) " 	
-				       "Received at %d: Cancel: Message(%d)\n",
-						alarm->alarmNum, time(NULL),alarm->alarmNum);
+				emitEvent(EV_CANCEL_REQUEST, alarm, 0);
 				previous = head;
 			    next = head->link;
 				while (next != tail)
@@ -240,18 +984,42 @@ void alarm_insert (alarm_t *alarm)
  * Periodically displays the alarm message, Frequency is specified in the alarm
  * by user input.
  * Each alarm is handled by its own thread.
+ * Between displays the thread waits on the alarm's condition variable until
+ * its next deadline, so a replacement re-arms it to the new period and a
+ * cancellation terminates it (and frees the alarm) right away.
  * Terminates when the alarm is cancled by the user.
  */
 void *periodic_display_thread (void *arg)
 {
     alarm_t *alarm;
+    stream_t *stream;
+    struct timespec cond_time;
+    time_t now, deadline, expires, wait;
     int status;
-    int sleeptime;
     int flag;
+    int armed;    /* alarm->version the deadline was computed for */
+    int displays; /* number of displays since the alarm was (re)armed */
+    int retire;   /* the alarm has expired = 1, 0 otherwise */
 	
     flag = 0; /* Used to identify the first time the alarm was modified for
 		 proper output */
+    armed = 0; /* versions start at 1: not armed yet */
+    deadline = 0;
+    displays = 0;
+    retire = 0;
     alarm = arg;
+    stream = (stream_t*)malloc (sizeof (stream_t));
+    if (stream == NULL)
+        errno_abort ("Allocate stream");
+    stream->pending = 0;
+    stream->priority = alarm->priority;
+    stream->closed = 0;
+    status = pthread_cond_init (&stream->room, NULL);
+    if (status != 0)
+        err_abort (status, "Init cond");
+    status = pthread_detach (pthread_self ());
+    if (status != 0)
+        err_abort (status, "Detach thread");
     while(1)
     {
 		/* Reader locking setup */
@@ -271,12 +1039,10 @@ void *periodic_display_thread (void *arg)
 		/* Reader locking setup complete */	
 
 		/* Reading is performed */
-		sleeptime = alarm->seconds;
+		now = time(NULL);
 		if(alarm->linked == 0)
 		{
-		    printf("Display thread exiting at %d: %d Message(%d) %s\n",
-			time(NULL), alarm->seconds, alarm->alarmNum,
-			alarm->message);
+		    queueFire(stream, EV_THREAD_EXITING, alarm, 0);
 
 		    /* Reader unlocking setup before thread termination*/
 		    status = pthread_mutex_lock (&mutex);
@@ -294,27 +1060,81 @@ void *periodic_display_thread (void *arg)
 	            err_abort (status, "Unlock mutex");
 		    /* Reader unlocking setup complete*/
 
+		    /* The alarm is out of the list, nobody else can reach it */
+		    freeAlarm(alarm);
 		    return NULL;
 		}
-		if (alarm->modified == 0)
-		    printf("Alarm With Message Number (%d) Displayed at %d: "
-			"%d Message(%d) %s\n",
-			alarm->alarmNum, time(NULL), alarm->seconds, alarm->alarmNum,
-			alarm->message);
-		if (alarm->modified == 1 && flag)
+		if (armed == 0)
 		{
-		    printf("Replacement Alarm With Message Number (%d) Displayed at "
-			   "%d: %d Message(%d) %s\n",
-			alarm->alarmNum, time(NULL), alarm->seconds, alarm->alarmNum,
-			alarm->message);
+		    /*
+		     * First pass: display now, then once every period. A
+		     * deadline of 0 marks the display as not being timed.
+		     */
+		    armed = alarm->version;
+		    deadline = 0;
 		}
-		if (alarm->modified == 1 && !flag)
+		else if (alarm->version != armed)
 		{
-		    printf("Alarm With Message Number (%d) Replaced at %d: "
-			"%d Message(%d) %s\n",
-			alarm->alarmNum, time(NULL), alarm->seconds, alarm->alarmNum,
-			alarm->message);
-		    flag = 1;
+		    /*
+		     * Replaced while waiting: re-arm to the new period. Every
+		     * replacement bumps the version, even one that leaves the
+		     * deadline where it was.
+		     */
+		    armed = alarm->version;
+		    deadline = alarm->time;
+		    displays = 0;
+		    if (alarm->modified == 1 && !flag)
+		    {
+			queueFire(stream, EV_REPLACED, alarm, 0);
+			flag = 1;
+		    }
+		}
+		expires = alarm->expires;
+		if (expires != 0 && now >= expires)
+		    retire = 1;
+		if (!retire && now >= deadline)
+		{
+		    if (alarm->modified == 0)
+			queueFire(stream, EV_DISPLAYED, alarm, deadline);
+		    if (alarm->modified == 1 && flag)
+		    {
+			queueFire(stream, EV_REPLACEMENT_DISPLAYED, alarm, deadline);
+		    }
+		    if (alarm->modified == 1 && !flag)
+		    {
+			queueFire(stream, EV_REPLACED, alarm, deadline);
+			flag = 1;
+		    }
+		    deadline += alarm->seconds;
+		    if (deadline <= now)
+			deadline = now + alarm->seconds;
+		    displays++;
+		    if (alarm->maxDisplays > 0 && displays >= alarm->maxDisplays)
+			retire = 1;
+		}
+		if (retire)
+		{
+		    /*
+		     * The alarm stays in the list until the alarm thread
+		     * reclaims it, which it may do as soon as the list is
+		     * unlocked: the alarm is not touched after that.
+		     */
+		    queueFire(stream, EV_EXPIRED, alarm, 0);
+		    queueFire(stream, EV_THREAD_EXITING, alarm, 0);
+		    alarm->retired = 1;
+		    status = pthread_mutex_lock (&work_mutex);
+		    if (status != 0)
+			err_abort (status, "Lock mutex");
+		    retired_count++;
+		    if (retired_count == 1 || retired_count >= RECLAIM_BATCH)
+		    {
+			status = pthread_cond_signal (&work_cond);
+			if (status != 0)
+			    err_abort (status, "Signal cond");
+		    }
+		    status = pthread_mutex_unlock (&work_mutex);
+		    if (status != 0)
+			err_abort (status, "Unlock mutex");
 		}
 		/* Reading is done */	
 
@@ -334,10 +1154,88 @@ void *periodic_display_thread (void *arg)
 	            err_abort (status, "Unlock mutex");
 		/* Reader unlocking setup complete*/
 
-		sleep(sleeptime); /* 
-				   * Threads sleeps for the time period of specified in
-				   * the alarm by the user input.
-				   */
+		if (retire)
+		    return NULL;
+
+		/*
+		 * Wait for the next deadline or the expiry time, whichever
+		 * comes first, or until a replacement or a cancellation wakes
+		 * the thread up.
+		 */
+		wait = deadline;
+		if (expires != 0 && expires < wait)
+		    wait = expires;
+		status = pthread_mutex_lock (&alarm->lock);
+		if (status != 0)
+		    err_abort (status, "Lock mutex");
+		cond_time.tv_sec = wait;
+		cond_time.tv_nsec = 0;
+		while (alarm->wakeup == 0)
+		{
+		    status = pthread_cond_timedwait (
+			&alarm->cond, &alarm->lock, &cond_time);
+		    if (status == ETIMEDOUT)
+			break;
+		    if (status != 0)
+			err_abort (status, "Cond timedwait");
+		}
+		alarm->wakeup = 0;
+		status = pthread_mutex_unlock (&alarm->lock);
+		if (status != 0)
+		    err_abort (status, "Unlock mutex");
+    }
+}
+
+/* Part of the ALARM thread.
+ *
+ * Unlinks every expired alarm from the alarm list in a single pass, then
+ * frees them all.
+ */
+void reclaimAlarms()
+{
+    alarm_t *next, *previous, *retired;
+    int status, count;
+
+    /* Writer locking rw_mutex */
+    status = pthread_mutex_lock (&rw_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    retired = NULL;
+    count = 0;
+    previous = head;
+    next = head->link;
+    while (next != tail)
+    {
+		if (next->retired == 1)
+		{
+		    previous->link = next->link;
+		    next->linked = 0;
+		    next->link = retired;
+		    retired = next;
+		    count++;
+		    next = previous->link;
+		    continue;
+		}
+		previous = next;
+		next = next->link;
+    }
+    status = pthread_mutex_unlock (&rw_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    /* Writer unlocking rw_mutex */
+
+    status = pthread_mutex_lock (&work_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    retired_count -= count;
+    status = pthread_mutex_unlock (&work_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    while (retired != NULL)
+    {
+		next = retired->link;
+		freeAlarm(retired);
+		retired = next;
     }
 }
 
@@ -351,8 +1249,9 @@ void *periodic_display_thread (void *arg)
  */
 void *alarm_thread (void *arg)
 {
-    alarm_t *alarm, *next, *previous;
-    int status, alarmToDelete;
+    alarm_t *alarm, *next, *previous, *canceled;
+    int status, alarmToDelete, reclaim, idle;
+    struct timespec cond_time;
     pthread_t thread;
 
     while (1) 
@@ -374,28 +1273,24 @@ void *alarm_thread (void *arg)
 		/* Reader locking setup complete */	
 
 		/* Reading is performed */
+		/* Take the most urgent new alarm, the first one on ties */
 		alarm = NULL;
 	    	next = head->link;
 		while (next != tail)
 		{
-		    if(next->new == 1)
-		    {
-				next->new = 0;
+		    if(next->new == 1
+			&& (alarm == NULL || next->priority < alarm->priority))
 				alarm = next;
-				break;
-		    }
 		    next = next->link;
 		}
+		if (alarm != NULL)
+		    alarm->new = 0;
 		if (alarm != NULL && alarm->type == 1)
 		{
-		    printf("Alarm Request With Message Number (%d) Proccessed at %d: "
-			"%d Message(%d) %s\n",
-			alarm->alarmNum, time(NULL), alarm->seconds, alarm->alarmNum,
-			alarm->message);
-		    status = pthread_create (
-	                &thread, NULL, periodic_display_thread, alarm);
-    	    if (status != 0)
-                err_abort (status, "Create alarm thread");
+		    emitEvent(EV_PROCESSED, alarm, 0);
+		    createThread(&thread, periodic_display_thread, alarm,
+			use_realtime && alarm->priority == CRITICAL_PRIORITY,
+			&display_cpus);
 		}
 		/* Reading is done */	
 
@@ -435,30 +1330,363 @@ void *alarm_thread (void *arg)
 		    	previous = next;
 		    	next = next->link;
 		    }
+		    canceled = NULL;
 		    next = head->link;
 		    previous = head;
 		    while (next != tail)
 		    {
-		        if(next->alarmNum == alarmToDelete)
+		        if(next->alarmNum == alarmToDelete && next->retired == 0)
 		        {
 				    next->linked = 0;
 				    previous->link = next->link;
+				    canceled = next;
 				    break;
 		        }
 				previous = next;
 		        next = next->link;
 		     }
-		    printf("Alarm Request With Message Number(%d) Proccessed at %d: "
-			"Cancel: Message(%d)\n",
-			alarm->alarmNum, time(NULL),alarm->alarmNum);
+		    emitEvent(EV_CANCEL_PROCESSED, alarm, 0);
+		    /*
+		     * The canceled alarm is freed by its display thread, which
+		     * is woken up now rather than at its next deadline. This is
+		     * done before unlocking, after which the display thread may
+		     * free the alarm at any time.
+		     */
+		    if (canceled != NULL && canceled->new == 0)
+		    {
+				wakeAlarm(canceled);
+				canceled = NULL;
+		    }
 		    status = pthread_mutex_unlock (&rw_mutex);
 		    if (status != 0)
 		    	err_abort (status, "Lock mutex");
 		     /* Writer unlocking rw_mutex */
+
+		    /*
+		     * The cancel request is done with, and so is the canceled
+		     * alarm if it never got a display thread.
+		     */
+		    freeAlarm(alarm);
+		    if (canceled != NULL)
+				freeAlarm(canceled);
+		    flushOutput();
 		}
+
+		/*
+		 * Without new requests in the list, wait for the main thread to
+		 * add some instead of searching the list again. Reclaim expired
+		 * alarms once a batch of them is waiting, or once idle.
+		 */
+		status = pthread_mutex_lock (&work_mutex);
+		if (status != 0)
+		    err_abort (status, "Lock mutex");
+		idle = 0;
+		if (alarm == NULL)
+		{
+		    /* The idle time is counted from the first expired alarm */
+		    cond_time.tv_sec = 0;
+		    cond_time.tv_nsec = 0;
+		    while (new_count == 0 && retired_count < RECLAIM_BATCH)
+		    {
+			if (retired_count == 0)
+			    status = pthread_cond_wait (&work_cond, &work_mutex);
+			else
+			{
+			    if (cond_time.tv_sec == 0)
+			    {
+				clock_gettime (CLOCK_REALTIME, &cond_time);
+				cond_time.tv_sec += RECLAIM_DELAY;
+			    }
+			    status = pthread_cond_timedwait (
+				&work_cond, &work_mutex, &cond_time);
+			}
+			if (status == ETIMEDOUT)
+			{
+			    idle = 1;
+			    break;
+			}
+			if (status != 0)
+			    err_abort (status, "Wait on cond");
+		    }
+		    new_count = 0;
+		}
+		reclaim = retired_count >= RECLAIM_BATCH
+		    || (idle && retired_count > 0);
+		status = pthread_mutex_unlock (&work_mutex);
+		if (status != 0)
+		    err_abort (status, "Unlock mutex");
+		if (reclaim)
+		    reclaimAlarms();
+    }
+}
+
+/* Part of the MAIN thread and the RING thread.
+ *
+ * Inserts a parsed alarm request into the alarm list and, if it was
+ * linked into it, tells the alarm thread about it.
+ */
+void submitAlarm(alarm_t *alarm)
+{
+    int status, linked;
+
+    /* Writer locking rw_mutex */
+    status = pthread_mutex_lock (&rw_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    alarm->time = time (NULL) + alarm->seconds;
+    alarm->expires = 0;
+    if (alarm->ttl > 0)
+        alarm->expires = time (NULL) + alarm->ttl;
+    alarm->retired = 0;
+    alarm->new = 1;
+    alarm->modified = 0;
+    alarm->linked = 0;
+    alarm->version = 1;
+    alarm->wakeup = 0;
+    status = pthread_mutex_init (&alarm->lock, NULL);
+    if (status != 0)
+        err_abort (status, "Init mutex");
+    status = pthread_cond_init (&alarm->cond, NULL);
+    if (status != 0)
+        err_abort (status, "Init cond");
+    /*
+     * Insert the new alarm into the alarm list,
+     * sorted by alarm number.
+     */
+    alarm_insert (alarm);
+    /* Once unlocked, a linked alarm may be freed at any time */
+    linked = alarm->linked;
+    status = pthread_mutex_unlock (&rw_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    /* Writer unlocking rw_mutex */
+
+    /*
+     * Replacements and rejected cancel requests are not linked into
+     * the alarm list, nothing refers to them anymore. Anything else
+     * is new work for the alarm thread.
+     */
+    if (linked == 0)
+        freeAlarm(alarm);
+    else
+    {
+        status = pthread_mutex_lock (&work_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        new_count++;
+        status = pthread_cond_signal (&work_cond);
+        if (status != 0)
+            err_abort (status, "Signal cond");
+        status = pthread_mutex_unlock (&work_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
     }
 }
 
+/*
+ * Shared memory submission.
+ * With "-s name", producer processes on the same host submit commands
+ * through the rings of the shared memory object "name" (see alarm_ring.h)
+ * in addition to stdin. The ring thread drains the rings and submits
+ * their commands exactly like the main thread submits command lines.
+ */
+ring_region_t *ring_region;	 /* the mapped rings, NULL without -s */
+char *ring_name;		 /* name of the shared memory object */
+latency_t ring_latency;		 /* time from a producer submitting a
+				  * command to its insertion, protected by
+				  * fire_mutex
+				  */
+
+/* HELPER METHOD
+ *
+ * Creates the shared memory object "name" and maps its rings, all empty
+ * and unclaimed. An existing object is left alone, as another alarm
+ * program may be using it: the program exits instead.
+ */
+void openRings(char *name)
+{
+    int fd;
+
+    fd = shm_open (name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+		fprintf (stderr, "%s already exists; remove it if no alarm "
+		    "program uses it\n", name);
+		exit (1);
+    }
+    if (fd < 0)
+        errno_abort ("Open shared memory");
+    if (ftruncate (fd, sizeof (ring_region_t)) != 0)
+        errno_abort ("Size shared memory");
+    ring_region = mmap (NULL, sizeof (ring_region_t),
+	PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring_region == MAP_FAILED)
+        errno_abort ("Map shared memory");
+    close (fd);
+    /* A new object is all zeros, which makes its rings empty and free */
+    atomic_store_explicit (&ring_region->consumer, getpid (),
+	memory_order_relaxed);
+    atomic_store_explicit (&ring_region->magic, RING_MAGIC,
+	memory_order_release);
+}
+
+/* HELPER METHOD
+ *
+ * Turns a ring command into an alarm request, as the main thread does
+ * with a command line. Returns NULL if the command is not valid.
+ */
+alarm_t *ringAlarm(ring_command_t *command)
+{
+    alarm_t *alarm;
+
+    if ((command->type != RING_ALARM && command->type != RING_CANCEL)
+	|| command->priority < 0 || command->priority >= NUM_PRIORITIES
+	|| command->maxDisplays < 0 || command->ttl < 0
+	|| (command->type == RING_ALARM && command->seconds <= 0))
+		return NULL;
+    alarm = (alarm_t*)malloc (sizeof (alarm_t));
+    if (alarm == NULL)
+        errno_abort ("Allocate alarm");
+    alarm->alarmNum = command->alarmNum;
+    alarm->priority = command->priority;
+    alarm->maxDisplays = 0;
+    alarm->ttl = 0;
+    if (command->type == RING_ALARM)
+    {
+		alarm->seconds = command->seconds;
+		alarm->maxDisplays = command->maxDisplays;
+		alarm->ttl = command->ttl;
+		strncpy (alarm->message, command->message, sizeof (alarm->message));
+		alarm->message[sizeof (alarm->message) - 1] = '\0';
+		alarm->type = 1;
+    }
+    else
+    {
+		alarm->seconds = 0;
+		strcpy(alarm->message,"Cancel command");
+		alarm->type = 0;
+    }
+    return alarm;
+}
+
+/*
+ * The ring thread.
+ * Drains the rings of every producer in turn. When they are all empty,
+ * sleeps on the doorbell until a producer rings it. The head of a ring
+ * is written by another process and is not trusted: a ring claiming
+ * more than RING_SLOTS commands is emptied without running any.
+ */
+void *ring_thread (void *arg)
+{
+    ring_command_t *command;
+    ring_t *ring;
+    alarm_t *alarm;
+    latency_t batch;
+    unsigned head, tail, seen;
+    int producer, found, status;
+    int64_t submitted, delay;
+
+    while (1)
+    {
+		found = 0;
+		batch.count = 0;
+		batch.total = 0;
+		batch.max = 0;
+		for (producer = 0; producer < RING_PRODUCERS; producer++)
+		{
+		    ring = &ring_region->rings[producer];
+		    tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+		    head = atomic_load_explicit (&ring->head, memory_order_acquire);
+		    if (head - tail > RING_SLOTS)
+		    {
+			fprintf (stderr, "Ring %d is corrupt, its commands are "
+			    "dropped\n", producer);
+			atomic_store_explicit (&ring->tail, head,
+			    memory_order_release);
+			found = 1;
+			continue;
+		    }
+		    for (; tail != head; tail++)
+		    {
+			/* Copy the command out, then hand the slot back */
+			command = &ring->slots[tail % RING_SLOTS];
+			alarm = ringAlarm(command);
+			submitted = command->submitted;
+			atomic_store_explicit (&ring->tail, tail + 1,
+			    memory_order_release);
+			found = 1;
+			if (alarm == NULL)
+			{
+			    fprintf (stderr, "Bad command\n");
+			    continue;
+			}
+			submitAlarm(alarm);
+			delay = ring_now() - submitted;
+			batch.count++;
+			batch.total += delay;
+			if (delay > batch.max)
+			    batch.max = delay;
+		    }
+		}
+		if (batch.count > 0)
+		{
+		    status = pthread_mutex_lock (&fire_mutex);
+		    if (status != 0)
+			err_abort (status, "Lock mutex");
+		    ring_latency.count += batch.count;
+		    ring_latency.total += batch.total;
+		    if (batch.max > ring_latency.max)
+			ring_latency.max = batch.max;
+		    status = pthread_mutex_unlock (&fire_mutex);
+		    if (status != 0)
+			err_abort (status, "Unlock mutex");
+		}
+		if (found)
+		    continue;
+
+		/*
+		 * Announce the sleep before looking at the rings a last time:
+		 * a producer publishing a command after that look sees
+		 * "sleeping" and rings the doorbell, which makes the futex
+		 * wait return at once if it has not started yet.
+		 */
+		flushOutput();
+		seen = atomic_load (&ring_region->doorbell);
+		atomic_store (&ring_region->sleeping, 1);
+		atomic_thread_fence (memory_order_seq_cst);
+		for (producer = 0; producer < RING_PRODUCERS; producer++)
+		{
+		    ring = &ring_region->rings[producer];
+		    if (atomic_load (&ring->head) != atomic_load (&ring->tail))
+			break;
+		}
+		if (producer == RING_PRODUCERS)
+		    ring_wait(ring_region, seen);
+		atomic_store (&ring_region->sleeping, 0);
+    }
+}
+
+/* HELPER METHOD
+ *
+ * Prints the submission latency of the ring commands to stderr.
+ */
+void printRingLatency()
+{
+    int status;
+
+    status = pthread_mutex_lock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (ring_latency.count > 0)
+		fprintf (stderr, "Rings: %ld commands, latency average %.3f ms, "
+		    "maximum %.3f ms\n", ring_latency.count,
+		    ring_latency.total / 1e6 / ring_latency.count,
+		    ring_latency.max / 1e6);
+    status = pthread_mutex_unlock (&fire_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
 /*
  * The main thread.
  * Reads and parses the user input correctly. 
@@ -471,11 +1699,66 @@ int main (int argc, char *argv[])
     char line[128];
     alarm_t *alarm;
     pthread_t thread;
+    char *command;
+    int option, consumed, priority;
+    cpu_set_t *cpus;
     int flag; /* 
 	       * flag = 1 if input was parsed correctly as either type A or B
   	       * alarm. flag = 0 otherwise.
 	       */
 
+    /*
+     * Every kind of thread starts out on the CPUs the program was
+     * started on.
+     */
+    if (sched_getaffinity (0, sizeof (cpu_set_t), &input_cpus) != 0)
+        errno_abort ("Get affinity");
+    dispatcher_cpus = output_cpus = display_cpus = input_cpus;
+
+    /*
+     * Select the output mode: "-f text" (default), "-f binary" for event
+     * records or "-f json" for JSON Lines.
+     * Select the CPUs of the main thread (-i), the alarm thread (-d), the
+     * output workers (-o) and the display threads (-w), and real time
+     * scheduling for the alarm thread and the P0 threads (-r).
+     * Accept commands from producer processes through the rings of the
+     * shared memory object given with -s, such as "-s /alarms".
+     */
+    while ((option = getopt (argc, argv, "f:i:d:o:w:rs:")) != -1)
+    {
+		cpus = NULL;
+		if (option == 'f' && strcmp (optarg, "text") == 0)
+		    output_mode = OUTPUT_TEXT;
+		else if (option == 'f' && strcmp (optarg, "binary") == 0)
+		    output_mode = OUTPUT_BINARY;
+		else if (option == 'f' && strcmp (optarg, "json") == 0)
+		    output_mode = OUTPUT_JSON;
+		else if (option == 'i')
+		    cpus = &input_cpus;
+		else if (option == 'd')
+		    cpus = &dispatcher_cpus;
+		else if (option == 'o')
+		    cpus = &output_cpus;
+		else if (option == 'w')
+		    cpus = &display_cpus;
+		else if (option == 'r')
+		    use_realtime = 1;
+		else if (option == 's')
+		    ring_name = optarg;
+		else
+		    option = '?';
+		if (option == '?' || (cpus != NULL && !parseCpuList (optarg, cpus)))
+		{
+		    fprintf (stderr, "Usage: %s [-f text|binary|json] [-i cpus] "
+			"[-d cpus] [-o cpus] [-w cpus] [-r] [-s name]\n", argv[0]);
+		    exit (1);
+		}
+    }
+    status = pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t),
+	&input_cpus);
+    if (status != 0)
+        err_abort (status, "Set affinity");
+
     /* 
      * Initializing the dummy variables of the alarm list.
      * The "head" is the front of the alarm list, and the "tail" is the end of 
@@ -489,29 +1772,75 @@ int main (int argc, char *argv[])
     head->link = tail;
     head->alarmNum = -1;   /* Used for debugging purposes only */
     read_count = 0;	   /* Initializing reader count to 0 */
-    status = pthread_create (&thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort (status, "Create alarm thread");
+    createThread(&thread, alarm_thread, NULL, use_realtime,
+	&dispatcher_cpus);
+    for (priority = CRITICAL_PRIORITY; priority <= CRITICAL_PRIORITY + 1;
+	priority++)
+		createThread(&thread, output_worker_thread,
+		    (void *)(intptr_t)priority,
+		    use_realtime && priority == CRITICAL_PRIORITY, &output_cpus);
+    if (ring_name != NULL)
+    {
+		openRings(ring_name);
+		createThread(&thread, ring_thread, NULL, 0, &input_cpus);
+    }
     while (1) 
     {
 		flag = 1;
-        printf ("Alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
+		/* The prompt is only part of the human readable output */
+		if (output_mode == OUTPUT_TEXT)
+	        printf ("Alarm> ");
+		flushOutput();
+        if (fgets (line, sizeof (line), stdin) == NULL)
+	{
+		drainFires();
+		printLatency();
+		if (ring_region != NULL)
+		{
+		    printRingLatency();
+		    shm_unlink (ring_name);
+		}
+		exit (0);
+	}
         if (strlen (line) <= 1) continue;
         alarm = (alarm_t*)malloc (sizeof (alarm_t));
         if (alarm == NULL)
             errno_abort ("Allocate alarm");
+	/*
+	 * Parse an optional priority class "P<n>" (%d) in front of the
+	 * command, 0 being the most urgent. Alarms without one are bulk.
+	 */
+	command = line;
+	consumed = 0;
+	priority = DEFAULT_PRIORITY;
+	if (sscanf (line, "P%d %n", &priority, &consumed) == 1 && consumed > 0)
+		command = line + consumed;
+	alarm->priority = priority;
+	alarm->maxDisplays = 0;
+	alarm->ttl = 0;
+	consumed = 0;
         /*
-         * Parse input line into seconds (%d), a message number (%d) and a 
-	 * message (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
+         * Parse input line into seconds (%d), a message number (%d),
+	 * optional lifetime limits and a message (%64[^\n]), consisting
+	 * of up to 64 characters separated from the seconds by whitespace.
          */
-        if (sscanf (line, "%d Message(%d) %64[^\n]", 
-            &alarm->seconds, &alarm->alarmNum, alarm->message) < 3) 
+        if (priority < 0 || priority >= NUM_PRIORITIES)
+        {
+	    	/* Error in case the priority class does not exist */
+        	fprintf (stderr, "Bad command\n");
+           	free (alarm);
+			flag = 0;
+        }
+        else if (sscanf (command, "%d Message(%d) %n",
+            &alarm->seconds, &alarm->alarmNum, &consumed) < 2 || consumed == 0
+	    || alarm->seconds <= 0
+	    || sscanf (ring_parse_limits(command + consumed,
+		&alarm->maxDisplays, &alarm->ttl), "%64[^\n]",
+	    alarm->message) < 1)
 	    /*
              * Parse input line into a message number (%d)
              */
-	    if (sscanf (line, "Cancel: Message(%d)",
+	    if (sscanf (command, "Cancel: Message(%d)",
 	        &alarm->alarmNum) < 1)
         {
 	    	/* Error in case the input is wrong */
@@ -528,23 +1857,6 @@ int main (int argc, char *argv[])
 	    }
         else alarm->type = 1;
         if (flag) 
-        {
-	    /* Writer locking rw_mutex */
-            status = pthread_mutex_lock (&rw_mutex);
-            if (status != 0)
-                err_abort (status, "Lock mutex");
-            alarm->time = time (NULL) + alarm->seconds;
-		    alarm->new = 1;
-		    alarm->modified = 0;
-            /*
-             * Insert the new alarm into the alarm list,
-             * sorted by alarm number.
-             */
-            alarm_insert (alarm);
-            status = pthread_mutex_unlock (&rw_mutex);
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
-	    /* Writer unlocking rw_mutex */
-        }
+            submitAlarm(alarm);
     }
 }
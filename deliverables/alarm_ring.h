@@ -0,0 +1,137 @@
+#ifndef __alarm_ring_h
+#define __alarm_ring_h
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Shared memory submission rings.
+ *
+ * The alarm program started with "-s name" creates the POSIX shared
+ * memory object "name", holding one ring per producer process. Each ring
+ * has a single producer and a single consumer (the alarm program's ring
+ * thread), so submitting a command is a copy into the next slot followed
+ * by a release store of the ring's head, without any system call.
+ *
+ * The consumer only sleeps when every ring is empty. It then announces
+ * it in "sleeping" and waits on the "doorbell" futex; a producer that
+ * sees "sleeping" set after publishing a command rings the doorbell,
+ * which is the only system call on the submission path.
+ */
+#define RING_MAGIC		0x414c524d /* "ALRM" */
+#define RING_PRODUCERS		8	/* producer processes at a time */
+#define RING_SLOTS		1024	/* commands per ring, a power of 2 */
+#define RING_CACHE_LINE		64
+
+#define RING_ALARM		1	/* type A alarm, or its replacement */
+#define RING_CANCEL		2	/* type B alarm */
+
+/*
+ * Command syntax shared by the alarm program and its producers.
+ * Commands may be preceded by a priority class "P<n>", from P0 (most
+ * urgent) to P3 (bulk, the default).
+ */
+#define NUM_PRIORITIES		4
+#define DEFAULT_PRIORITY	(NUM_PRIORITIES - 1)
+
+/*
+ * A command, with the same fields as a command line of the alarm
+ * program. "submitted" is the CLOCK_MONOTONIC time of submission, in
+ * nanoseconds, used to measure submission latency.
+ */
+typedef struct ring_command_tag {
+    int32_t          type;       /* RING_ALARM or RING_CANCEL */
+    int32_t          alarmNum;   /* the alarm message number */
+    int32_t          seconds;    /* the alarm period */
+    int32_t          priority;   /* priority class, 0 = most urgent */
+    int32_t          maxDisplays;/* "x<N>" limit, 0 = none */
+    int32_t          ttl;        /* "t<S>" limit, 0 = none */
+    int64_t          submitted;  /* when the command was submitted */
+    char             message[64];/* the alarm message, NUL terminated */
+} ring_command_t;
+
+/*
+ * The ring of one producer. "head" and "tail" count commands since the
+ * ring was created; the slot of a command is its count modulo
+ * RING_SLOTS. They live on separate cache lines so that the producer
+ * and the consumer do not write to the same line.
+ */
+typedef struct ring_tag {
+    _Alignas (RING_CACHE_LINE)
+    atomic_int       owner;      /* pid of the producer, 0 = free */
+    _Alignas (RING_CACHE_LINE)
+    atomic_uint      head;       /* written by the producer only */
+    _Alignas (RING_CACHE_LINE)
+    atomic_uint      tail;       /* written by the consumer only */
+    _Alignas (RING_CACHE_LINE)
+    ring_command_t   slots[RING_SLOTS];
+} ring_t;
+
+typedef struct ring_region_tag {
+    atomic_uint      magic;      /* RING_MAGIC once initialized */
+    atomic_int       consumer;   /* pid of the alarm program */
+    _Alignas (RING_CACHE_LINE)
+    atomic_uint      doorbell;   /* futex word, bumped to wake consumer */
+    atomic_uint      sleeping;   /* consumer waits on doorbell = 1 */
+    ring_t           rings[RING_PRODUCERS];
+} ring_region_t;
+
+/*
+ * Futex operations on the doorbell. The region is shared between
+ * processes, so the non private futex operations are used.
+ */
+static inline void ring_wait(ring_region_t *region, unsigned seen)
+{
+    syscall (SYS_futex, &region->doorbell, FUTEX_WAIT, seen, NULL, NULL, 0);
+}
+
+static inline void ring_wake(ring_region_t *region)
+{
+    atomic_fetch_add (&region->doorbell, 1);
+    syscall (SYS_futex, &region->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Parses the optional lifetime limits of a type A alarm in front of its
+ * message: "x<N>" for the alarm to expire after N displays, "t<S>" for
+ * it to expire S seconds after the request. Limits that are not given
+ * are left unchanged.
+ * Returns the rest of the text, which is the message.
+ */
+static inline char *ring_parse_limits(char *text, int *maxDisplays, int *ttl)
+{
+    int value, consumed;
+
+    while ((text[0] == 'x' || text[0] == 't')
+	&& isdigit ((unsigned char)text[1]))
+    {
+		consumed = 0;
+		if (sscanf (text + 1, "%d%n", &value, &consumed) < 1
+		    || value <= 0 || !isspace ((unsigned char)text[1 + consumed]))
+		    break;
+		if (text[0] == 'x')
+		    *maxDisplays = value;
+		else
+		    *ttl = value;
+		text += 1 + consumed;
+		while (isspace ((unsigned char)*text))
+		    text++;
+    }
+    return text;
+}
+
+static inline int64_t ring_now()
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif
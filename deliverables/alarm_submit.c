@@ -0,0 +1,219 @@
+/*
+ * alarm_submit.c
+ *
+ * This program submits commands to an alarm program started with
+ * "-s name", through a ring of the shared memory object "name".
+ * It reads command lines from stdin, in the same syntax as the alarm
+ * program, and submits them without going through the alarm program's
+ * stdin.
+ * With "-n count" it instead benchmarks the rings: it submits count
+ * alarm requests, replacing the same 16 alarms over and over, and
+ * reports how many it submitted per second.
+ */
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "errors.h"
+#include "alarm_ring.h"
+
+#define BENCH_ALARMS		16	/* alarms replaced by the benchmark */
+
+ring_region_t *region;		 /* the mapped rings */
+ring_t *ring;			 /* the ring claimed by this producer */
+unsigned head;			 /* next command to submit, our copy of
+				  * ring->head
+				  */
+unsigned tail;			 /* last known ring->tail, reread only
+				  * when the ring looks full
+				  */
+
+/*
+ * Exits with an error if the alarm program that created the rings is no
+ * longer running, for example after it was stopped with Ctrl-c, as
+ * nothing would ever drain the ring then.
+ */
+void checkConsumer()
+{
+    pid_t pid;
+
+    pid = atomic_load_explicit (&region->consumer, memory_order_relaxed);
+    if (kill (pid, 0) != 0 && errno == ESRCH)
+    {
+		fprintf (stderr, "The alarm program of the rings has exited\n");
+		exit (1);
+    }
+}
+
+/*
+ * Submits a command through the ring, waiting for a free slot if the
+ * alarm program is behind. Rings the doorbell only if the alarm
+ * program's ring thread went to sleep.
+ */
+void submitCommand(ring_command_t *command)
+{
+    while (head - tail == RING_SLOTS)
+    {
+		tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+		if (head - tail == RING_SLOTS)
+		{
+		    checkConsumer();
+		    sched_yield ();
+		}
+    }
+    command->submitted = ring_now();
+    ring->slots[head % RING_SLOTS] = *command;
+    head++;
+    atomic_store_explicit (&ring->head, head, memory_order_release);
+    atomic_thread_fence (memory_order_seq_cst);
+    if (atomic_load_explicit (&region->sleeping, memory_order_relaxed))
+		ring_wake(region);
+}
+
+/*
+ * Parses a command line into a ring command:
+ *     [P<n>] <seconds> Message(<number>) [x<N>] [t<S>] <message>
+ *     [P<n>] Cancel: Message(<number>)
+ * Returns 1 if the line is a valid command, 0 otherwise.
+ */
+int parseCommand(char *line, ring_command_t *command)
+{
+    int consumed;
+
+    memset (command, 0, sizeof (ring_command_t));
+    command->priority = DEFAULT_PRIORITY;
+    consumed = 0;
+    if (sscanf (line, "P%d %n", &command->priority, &consumed) == 1
+	&& consumed > 0)
+		line += consumed;
+    if (command->priority < 0 || command->priority >= NUM_PRIORITIES)
+		return 0;
+    consumed = 0;
+    if (sscanf (line, "%d Message(%d) %n",
+	&command->seconds, &command->alarmNum, &consumed) == 2 && consumed > 0
+	&& command->seconds > 0)
+    {
+		command->type = RING_ALARM;
+		line += consumed;
+		line = ring_parse_limits(line, &command->maxDisplays,
+		    &command->ttl);
+		return sscanf (line, "%63[^\n]", command->message) == 1;
+    }
+    command->type = RING_CANCEL;
+    return sscanf (line, "Cancel: Message(%d)", &command->alarmNum) == 1;
+}
+
+int main (int argc, char *argv[])
+{
+    char line[128];
+    char *name;
+    ring_command_t command;
+    struct timespec start, end;
+    int owner;
+    long count, i;
+    double elapsed;
+    int fd, option, producer;
+
+    name = NULL;
+    count = 0;
+    while ((option = getopt (argc, argv, "s:n:")) != -1)
+    {
+		if (option == 's')
+		    name = optarg;
+		else if (option == 'n')
+		    count = atol (optarg);
+		else
+		    name = NULL;
+    }
+    if (name == NULL)
+    {
+		fprintf (stderr, "Usage: %s -s name [-n count]\n", argv[0]);
+		exit (1);
+    }
+
+    fd = shm_open (name, O_RDWR, 0);
+    if (fd < 0)
+        errno_abort ("Open shared memory");
+    region = mmap (NULL, sizeof (ring_region_t), PROT_READ | PROT_WRITE,
+	MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED)
+        errno_abort ("Map shared memory");
+    close (fd);
+    if (atomic_load_explicit (&region->magic, memory_order_acquire)
+	!= RING_MAGIC)
+    {
+		fprintf (stderr, "%s is not an alarm ring\n", name);
+		exit (1);
+    }
+    checkConsumer();
+
+    /*
+     * Claim the first free ring, or else the first ring whose producer
+     * was killed before it could release it.
+     */
+    for (producer = 0; producer < RING_PRODUCERS; producer++)
+    {
+		owner = 0;
+		if (atomic_compare_exchange_strong (
+		    &region->rings[producer].owner, &owner, getpid ()))
+		    break;
+		if (kill (owner, 0) != 0 && errno == ESRCH
+		    && atomic_compare_exchange_strong (
+		    &region->rings[producer].owner, &owner, getpid ()))
+		    break;
+    }
+    if (producer == RING_PRODUCERS)
+    {
+		fprintf (stderr, "All %d rings are in use\n", RING_PRODUCERS);
+		exit (1);
+    }
+    ring = &region->rings[producer];
+    head = atomic_load (&ring->head);
+    tail = atomic_load (&ring->tail);
+
+    if (count > 0)
+    {
+		/*
+		 * Benchmark: every producer replaces its own BENCH_ALARMS
+		 * alarms, so that the alarm program creates no more than
+		 * that many display threads per producer.
+		 */
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+		{
+		    memset (&command, 0, sizeof (command));
+		    command.type = RING_ALARM;
+		    command.alarmNum = (producer + 1) * 1000 + i % BENCH_ALARMS;
+		    command.seconds = 3600;
+		    command.priority = DEFAULT_PRIORITY;
+		    strcpy (command.message, "Benchmark");
+		    submitCommand(&command);
+		}
+		while (atomic_load_explicit (&ring->tail, memory_order_acquire)
+		    != head)
+		{
+		    checkConsumer();
+		    sched_yield ();
+		}
+		clock_gettime (CLOCK_MONOTONIC, &end);
+		elapsed = (end.tv_sec - start.tv_sec)
+		    + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf ("Ring %d: %ld commands in %.3f s, %.0f commands/s\n",
+		    producer, count, elapsed, count / elapsed);
+    }
+    else
+    {
+		while (fgets (line, sizeof (line), stdin) != NULL)
+		{
+		    if (strlen (line) <= 1) continue;
+		    if (parseCommand(line, &command))
+			submitCommand(&command);
+		    else
+			fprintf (stderr, "Bad command\n");
+		}
+    }
+
+    /* The alarm program keeps draining commands left in the ring */
+    atomic_store (&ring->owner, 0);
+    return 0;
+}